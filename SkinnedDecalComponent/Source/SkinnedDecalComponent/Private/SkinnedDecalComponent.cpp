@@ -1,6 +1,7 @@
 // Copyright Eddie Ataberk 2021 All Rights Reserved.
 
 #include "SkinnedDecalComponent.h"
+#include "SkinnedDecalTrace.h"
 
 #define LOCTEXT_NAMESPACE "FSkinnedDecalComponentModule"
 
@@ -16,6 +17,8 @@ void FSkinnedDecalComponentModule::ShutdownModule()
 {
 	// This function may be called during shutdown to clean up your module.  For modules that support dynamic reloading,
 	// we call this function before unloading the module.
+	FSkinnedDecalTraceRecorder::Stop();
+	FSkinnedDecalTraceReplayer::StopReplay();
 }
 
 #undef LOCTEXT_NAMESPACE
@@ -70,7 +70,7 @@ void USkinnedDecalInstance::UpdateDecal()
 		return;
 	}
 #endif
-	Index = SamplerComponent->SpawnDecal(GetComponentLocation(), GetComponentQuat(), GetAttachSocketName(), Size, SubUV, Index);
+	Index = SamplerComponent->SpawnDecal(GetComponentLocation(), GetComponentQuat(), GetAttachSocketName(), Size, SubUV, Index, Layer);
 	
 }
 
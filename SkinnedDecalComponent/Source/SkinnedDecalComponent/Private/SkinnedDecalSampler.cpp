@@ -9,6 +9,7 @@
 #include "Materials/MaterialInstanceDynamic.h"
 #include "AnimationRuntime.h"
 #include "Kismet/GameplayStatics.h"
+#include "SkinnedDecalTrace.h"
 
 #define PRE427 ENGINE_MAJOR_VERSION < 5 && ENGINE_MINOR_VERSION < 27
 
@@ -73,9 +74,18 @@ void USkinnedDecalSampler::CloneDecals(USkinnedDecalSampler* Source)
 		return;
 	}
 	
+	if (FSkinnedDecalTraceRecorder::IsRecording())
+	{
+		FSkinnedDecalTraceRecorder::RecordClone(this, Source);
+	}
+	
 	DecalLocations = Source->DecalLocations;
 	MaxDecals = Source->MaxDecals;
+	Layers = Source->Layers;
+	MaterialsSupportDecalOffset = Source->MaterialsSupportDecalOffset;
+	ActiveLayers = Source->ActiveLayers;
 	EmptyIndexes = Source->EmptyIndexes;
+	Clusters = Source->Clusters;
 	LastDecalIndex = Source->LastDecalIndex;
 	DataTarget = Source->GetDataTarget(); //Cast<UTextureRenderTarget2D>(StaticDuplicateObject(Target->GetDataTarget(), Target->GetOuter()));
 	Materials.Empty();
@@ -86,12 +96,112 @@ UTextureRenderTarget2D* USkinnedDecalSampler::GetDataTarget()
 {
 	if (!DataTarget)
 	{
-		DataTarget = UKismetRenderingLibrary::CreateRenderTarget2D(this, MaxDecals*5, 1, RTF_RGBA16f, FLinearColor::Black, false);
+		InitLayers();
+		DataTarget = UKismetRenderingLibrary::CreateRenderTarget2D(this, GetDecalSlotCount()*5, 1, RTF_RGBA16f, FLinearColor::Black, false);
 	}
 
 	return DataTarget;	
 }
 
+void USkinnedDecalSampler::InitLayers()
+{
+	//Layers is only the setup, the layout in use lives in ActiveLayers
+	TArray<FSkinnedDecalLayer, TInlineAllocator<4>> Setup;
+	if (!Layers.IsValidIndex(0))
+	{
+		FSkinnedDecalLayer& Layer = Setup.AddDefaulted_GetRef();
+		Layer.LayerIndex = LayerIndex;
+		Layer.Association = Association;
+		Layer.MaxDecals = MaxDecals;
+	}
+	else
+	{
+		Setup.Append(Layers.GetData(), MaterialsSupportDecalOffset ? Layers.Num() : 1);
+	}
+
+	bool bLayoutChanged = Setup.Num() != ActiveLayers.Num();
+	int32 Offset = 0;
+	for (int32 i = 0; i < Setup.Num(); ++i)
+	{
+		FSkinnedDecalLayer& Layer = Setup[i];
+		Layer.MaxDecals = FMath::Max(Layer.MaxDecals, 1);
+		Layer.Offset = Offset;
+		Offset += Layer.MaxDecals;
+
+		bLayoutChanged = bLayoutChanged
+			|| Layer.Name != ActiveLayers[i].Name
+			|| Layer.LayerIndex != ActiveLayers[i].LayerIndex
+			|| Layer.Association != ActiveLayers[i].Association
+			|| Layer.MaxDecals != ActiveLayers[i].MaxDecals;
+	}
+
+	if (!bLayoutChanged)
+	{
+		return;
+	}
+
+	if (Layers.Num() > 1 && !MaterialsSupportDecalOffset)
+	{
+		UE_LOG(LogTemp, Error, TEXT("%s has %d decal layers but MaterialsSupportDecalOffset is off, only layer %s is used. The decal material functions must add DecalOffset to the slot index first."),
+			*GetName(), Layers.Num(), *Layers[0].Name.ToString());
+	}
+
+	ActiveLayers.Reset(Setup.Num());
+	for (FSkinnedDecalLayer& Layer : Setup)
+	{
+		Layer.LastDecalIndex = -1;
+		Layer.NumDecals = 0;
+		ActiveLayers.Add(Layer);
+	}
+
+	if (!DataTarget)
+	{
+		return;
+	}
+
+	//Layers were added or resized after the data texture was made, slots moved so existing decals are dropped
+	UE_LOG(LogTemp, Warning, TEXT("Decal layers changed, recreating the data texture and clearing decals"));
+	DataTarget = nullptr;
+	DecalLocations.Empty();
+	EmptyIndexes.Empty();
+	Clusters.Empty();
+	LastDecalIndex = -1;
+
+	for (UMaterialInstanceDynamic* DynamicMaterial : Materials)
+	{
+		if (!IsValid(DynamicMaterial)) continue;
+
+		for (const FSkinnedDecalLayer& Layer : ActiveLayers)
+		{
+			SetLayerParameters(DynamicMaterial, Layer);
+		}
+	}
+}
+
+int32 USkinnedDecalSampler::GetDecalSlotCount() const
+{
+	int32 Count = 0;
+	for (const FSkinnedDecalLayer& Layer : ActiveLayers)
+	{
+		Count += Layer.MaxDecals;
+	}
+	return Count;
+}
+
+int32 USkinnedDecalSampler::FindLayer(FName Layer) const
+{
+	if (Layer.IsNone())
+	{
+		return ActiveLayers.IsValidIndex(0) ? 0 : INDEX_NONE;
+	}
+	return ActiveLayers.IndexOfByPredicate([Layer](const FSkinnedDecalLayer& Item) { return Item.Name == Layer; });
+}
+
+int32 USkinnedDecalSampler::GetLayerOfDecal(int32 Index) const
+{
+	return ActiveLayers.IndexOfByPredicate([Index](const FSkinnedDecalLayer& Item) { return Index >= Item.Offset && Index < Item.Offset + Item.MaxDecals; });
+}
+
 void USkinnedDecalSampler::UpdateInstance(USkinnedDecalInstance* Instance)
 {
     int32 DecalID = -1;
@@ -103,7 +213,7 @@ void USkinnedDecalSampler::UpdateInstance(USkinnedDecalInstance* Instance)
 	{
 		UE_LOG(LogTemp, Warning, TEXT("Can't find the Instance Component"))
 	}
-	DecalID = SpawnDecal(Instance->GetComponentLocation(),Instance->GetComponentQuat(),Instance->GetAttachSocketName(),Instance->Size, Instance->SubUV, DecalID);
+	DecalID = SpawnDecal(Instance->GetComponentLocation(),Instance->GetComponentQuat(),Instance->GetAttachSocketName(),Instance->Size, Instance->SubUV, DecalID, Instance->Layer);
 	InstanceMap.Add(Instance, DecalID);
 
 }
@@ -149,33 +259,55 @@ void USkinnedDecalSampler::SetupComponentMaterials(USkeletalMeshComponent* Compo
 			}
 			if (DynamicMaterial)
 			{
-				DynamicMaterial->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalMax", Association, LayerIndex), MaxDecals*5);
-				DynamicMaterial->SetTextureParameterValueByInfo(FMaterialParameterInfo("DecalInfo", Association, LayerIndex), GetDataTarget());
-				DynamicMaterial->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", Association, LayerIndex), DecalLocations.Num());
+				InitLayers();
+				for (const FSkinnedDecalLayer& Layer : ActiveLayers)
+				{
+					SetLayerParameters(DynamicMaterial, Layer);
+				}
 				Materials.Add(DynamicMaterial);
 			}
 		}
 	}
 }
 
+void USkinnedDecalSampler::SetLayerParameters(UMaterialInstanceDynamic* DynamicMaterial, const FSkinnedDecalLayer& Layer)
+{
+	DynamicMaterial->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalMax", Layer.Association, Layer.LayerIndex), GetDecalSlotCount()*5);
+	DynamicMaterial->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalOffset", Layer.Association, Layer.LayerIndex), Layer.Offset);
+	DynamicMaterial->SetTextureParameterValueByInfo(FMaterialParameterInfo("DecalInfo", Layer.Association, Layer.LayerIndex), GetDataTarget());
+	DynamicMaterial->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", Layer.Association, Layer.LayerIndex), Layer.NumDecals);
+}
+
 void USkinnedDecalSampler::ClearAllDecals()
 {
+	if (FSkinnedDecalTraceRecorder::IsRecording())
+	{
+		FSkinnedDecalTraceRecorder::RecordClear(this);
+	}
+	
 	if (DataTarget)
 	{
 		UKismetRenderingLibrary::ClearRenderTarget2D(this, DataTarget, FLinearColor::Black);
 	}
 	DecalLocations.Empty();
+	Clusters.Empty();
 	LastDecalIndex = 0;
-	for(int16 i=0; i<Materials.Num(); ++i)
+	for (FSkinnedDecalLayer& Layer : ActiveLayers)
 	{
-		if(IsValid(Materials[i]))
+		Layer.LastDecalIndex = 0;
+		Layer.NumDecals = 0;
+		
+		for(int16 i=0; i<Materials.Num(); ++i)
 		{
-			Materials[i]->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", Association, LayerIndex), 0.f);
+			if(IsValid(Materials[i]))
+			{
+				Materials[i]->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", Layer.Association, Layer.LayerIndex), 0.f);
+			}
 		}
 	}
 }
 
-int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName BoneName, float Size, int32 SubUV, int32 Index)
+int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName BoneName, float Size, int32 SubUV, int32 Index, FName Layer)
 {
 //	UE_LOG(LogTemp, Warning, TEXT("StartSpawnDecal"));
 
@@ -202,11 +334,81 @@ int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName B
 	const int32 BoneIndex = Mesh->GetBoneIndex(BoneName);
 	const FTransform ReferenceTransform = FAnimationRuntime::GetComponentSpaceTransformRefPose(RefSkeleton, BoneIndex);
 	const FVector DecalLocation = ReferenceTransform.TransformPosition(BoneWorldTransform.InverseTransformPosition(Location));
-	
+	const FQuat DecalRotation = ReferenceTransform.TransformRotation(BoneWorldTransform.InverseTransformRotation(Rotation));
+
+	return SpawnDecalInReferencePose(DecalLocation, DecalRotation, BoneIndex, Size, SubUV, Index, Layer);
+}
+
+int32 USkinnedDecalSampler::SpawnDecalInReferencePose(FVector DecalLocation, const FQuat DecalRotation, int32 BoneIndex, float Size, int32 SubUV, int32 Index, FName Layer)
+{
+	const int32 DecalIndex = SpawnDecalInternal(DecalLocation, DecalRotation, BoneIndex, Size, SubUV, Index, Layer);
+
+	if (FSkinnedDecalTraceRecorder::IsRecording())
+	{
+		const FName BoneName = Mesh ? Mesh->GetBoneName(BoneIndex) : NAME_None;
+		FSkinnedDecalTraceRecorder::RecordSpawn(this, BoneName, BoneIndex, DecalLocation, DecalRotation, Size, SubUV, Index, DecalIndex, Layer);
+	}
+
+	return DecalIndex;
+}
+
+int32 USkinnedDecalSampler::SpawnDecalInternal(const FVector& DecalLocation, const FQuat& DecalRotation, int32 BoneIndex, float Size, int32 SubUV, int32 Index, FName Layer)
+{
+	InitLayers();
+
+	//Without a layer name existing decals stay in their layer, with one an index outside that layer gets a new slot in it
+	int32 LayerID = Index < 0 ? INDEX_NONE : GetLayerOfDecal(Index);
+	if (LayerID == INDEX_NONE || !Layer.IsNone())
+	{
+		const int32 RequestedLayer = FindLayer(Layer);
+		if (RequestedLayer == INDEX_NONE)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Can't find decal layer %s"), *Layer.ToString());
+			return Index;
+		}
+		if (LayerID != RequestedLayer)
+		{
+			//The caller's slot is in another layer, free it before allocating in the requested one
+			if (LayerID != INDEX_NONE)
+			{
+				RemoveDecalSlot(Index);
+			}
+			LayerID = RequestedLayer;
+			Index = -1;
+		}
+	}
+	FSkinnedDecalLayer& DecalLayer = ActiveLayers[LayerID];
+	const int32 LayerEnd = FMath::Min(DecalLayer.Offset + DecalLayer.NumDecals, DecalLocations.Num());
+
+	//Merge into a nearby decal on the same bone
+	if (ClusterDecals && Index < 0)
+	{
+		const int32 ClusterIndex = FindCluster(DecalLayer, DecalLocation, BoneIndex);
+		if (ClusterIndex != INDEX_NONE)
+		{
+			FSkinnedDecalCluster& Cluster = Clusters[ClusterIndex];
+			++Cluster.Hits;
+
+			//Running average, every hit pulls the centre equally
+			const float Alpha = 1.f / Cluster.Hits;
+			DecalLocations[ClusterIndex] = FMath::Lerp(DecalLocations[ClusterIndex], DecalLocation, Alpha);
+			Cluster.Rotation = FQuat::Slerp(Cluster.Rotation, DecalRotation, Alpha);
+			Cluster.Size = FMath::Min(Cluster.Size + Size * ClusterGrowth, FMath::Max(ClusterMaxSize, Cluster.Size));
+			if (ClusterHitsPerSubUV > 0 && Cluster.Hits % ClusterHitsPerSubUV == 0 && Cluster.SubUV < ClusterMaxSubUV)
+			{
+				++Cluster.SubUV;
+			}
+
+			LastDecalIndex = ClusterIndex;
+			UploadDecal(ClusterIndex, DecalLocations[ClusterIndex], Cluster.Rotation, BoneIndex, Cluster.Size, Cluster.SubUV);
+			return ClusterIndex;
+		}
+	}
+
 	//Check Min Decal Distance
 	if(MinDecalDistance>0.f)
 	{
-		for (int16 i = 0; i < DecalLocations.Num(); ++i)
+		for (int32 i = DecalLayer.Offset; i < LayerEnd; ++i)
 		{
 			if (i == Index) continue;
 			
@@ -219,8 +421,6 @@ int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName B
 		}
 	}
 	
-	const FQuat DecalRotation = ReferenceTransform.TransformRotation(BoneWorldTransform.InverseTransformRotation(Rotation));
-
 	////////
 	// Determine Decal Index
 	
@@ -228,16 +428,17 @@ int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName B
 	//	UE_LOG(LogTemp, Warning, TEXT("DecalIndexDefault: %i"), DecalIndex);
 	if (Index < 0)
 	{
-		if(EmptyIndexes.IsValidIndex(0))
+		const int32* EmptyIndex = EmptyIndexes.FindByPredicate([&DecalLayer](int32 Item) { return Item >= DecalLayer.Offset && Item < DecalLayer.Offset + DecalLayer.MaxDecals; });
+		if(EmptyIndex)
 		{
-			DecalIndex = EmptyIndexes[0];
+			DecalIndex = *EmptyIndex;
 		}
 		else
 		{
-			DecalIndex = (LastDecalIndex + 1) % MaxDecals;
+			DecalIndex = DecalLayer.Offset + (DecalLayer.LastDecalIndex + 1) % DecalLayer.MaxDecals;
 		}
 		//	UE_LOG(LogTemp, Warning, TEXT("DecalIndexSetTo: %i"), DecalIndex);
-		LastDecalIndex = DecalIndex;
+		DecalLayer.LastDecalIndex = DecalIndex - DecalLayer.Offset;
 	}
 
 	if (DecalLocations.Num() - 1 < DecalIndex)
@@ -245,27 +446,70 @@ int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName B
 		DecalLocations.SetNumZeroed(DecalIndex + 1);
 	}
 	DecalLocations[DecalIndex] = DecalLocation;
+	//Slots passed in by the caller (instances) are owned by it and never merged into
+	if (ClusterDecals && Index < 0)
+	{
+		Clusters.SetNum(DecalLocations.Num());
+		Clusters[DecalIndex] = { DecalRotation, Size, SubUV, BoneIndex, 1 };
+	}
+	else if (Clusters.IsValidIndex(DecalIndex))
+	{
+		Clusters[DecalIndex].Hits = 0;
+	}
+	DecalLayer.NumDecals = FMath::Max(DecalLayer.NumDecals, DecalIndex - DecalLayer.Offset + 1);
 
 	if (!(Index < 0))
 	{
-		LastDecalIndex = DecalLocations.Num();
+		DecalLayer.LastDecalIndex = DecalLayer.NumDecals;
 	}
-	
+	LastDecalIndex = DecalIndex;
 	
 	for(int16 i=0; i<Materials.Num(); ++i)
 	{
 		if(!IsValid(Materials[i])) continue;
 		
-		Materials[i]->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", Association, LayerIndex), DecalLocations.Num());
+		Materials[i]->SetScalarParameterValueByInfo(FMaterialParameterInfo("DecalLast", DecalLayer.Association, DecalLayer.LayerIndex), DecalLayer.NumDecals);
 	}
 	
+	if (!UploadDecal(DecalIndex, DecalLocation, DecalRotation, BoneIndex, Size, SubUV))
+	{
+		return DecalIndex;
+	}
+
+	// UE_LOG(LogTemp, Warning, TEXT("SpawnDecal: %i"), DecalIndex);
+	EmptyIndexes.Remove(DecalIndex);
+	return DecalIndex;
+}
+
+int32 USkinnedDecalSampler::FindCluster(const FSkinnedDecalLayer& Layer, const FVector& DecalLocation, int32 BoneIndex) const
+{
+	int32 ClusterIndex = INDEX_NONE;
+	float ClosestDistance = FMath::Square(ClusterRadius);
+
+	const int32 LayerEnd = FMath::Min(Layer.Offset + Layer.MaxDecals, Clusters.Num());
+	for (int32 i = Layer.Offset; i < LayerEnd; ++i)
+	{
+		if (Clusters[i].Hits == 0 || Clusters[i].BoneIndex != BoneIndex) continue;
+
+		const float Distance = FVector::DistSquared(DecalLocation, DecalLocations[i]);
+		if (Distance < ClosestDistance)
+		{
+			ClosestDistance = Distance;
+			ClusterIndex = i;
+		}
+	}
+	return ClusterIndex;
+}
+
+bool USkinnedDecalSampler::UploadDecal(int32 DecalIndex, const FVector& DecalLocation, const FQuat& DecalRotation, int32 BoneIndex, float Size, int32 SubUV)
+{
 	UCanvas* Canvas;
 	FVector2D CanvasSize;
 	FDrawToRenderTargetContext RenderTargetContext;
 	UKismetRenderingLibrary::BeginDrawCanvasToRenderTarget(this, GetDataTarget(), /*out*/ Canvas, /*out*/ CanvasSize, /*out*/ RenderTargetContext);
 	if(!::IsValid(Canvas))
 	{
-		return DecalIndex;
+		return false;
 	}
 
 	float DataLocation = DecalIndex * 5 + 1;
@@ -305,17 +549,28 @@ int32 USkinnedDecalSampler::SpawnDecal(FVector Location, FQuat Rotation, FName B
 	Canvas->UCanvas::K2_DrawLine(FVector2D(DataLocation + 4, 0), FVector2D(DataLocation + 4, 1), 1, FLinearColor(Size, SubUV, AdditionalDataValue, 1));
 
 	UKismetRenderingLibrary::EndDrawCanvasToRenderTarget(this, RenderTargetContext);
-
-	// UE_LOG(LogTemp, Warning, TEXT("SpawnDecal: %i"), DecalIndex);
-	EmptyIndexes.Remove(DecalIndex);
-	return DecalIndex;
+	return true;
 }
 
 void USkinnedDecalSampler::RemoveDecal(const int32 Index)
 {
 	if(Index<0)	return;
 	
-	EmptyIndexes.Add(Index);
+	if (FSkinnedDecalTraceRecorder::IsRecording())
+	{
+		FSkinnedDecalTraceRecorder::RecordRemove(this, Index);
+	}
+
+	RemoveDecalSlot(Index);
+}
+
+void USkinnedDecalSampler::RemoveDecalSlot(const int32 Index)
+{
+	EmptyIndexes.AddUnique(Index);
+	if (Clusters.IsValidIndex(Index))
+	{
+		Clusters[Index].Hits = 0;
+	}
 	
 	UCanvas* Canvas;
 	FVector2D CanvasSize;
@@ -0,0 +1,569 @@
+// Copyright Eddie Ataberk 2021 All Rights Reserved.
+
+#include "SkinnedDecalTrace.h"
+#include "SkinnedDecalSampler.h"
+#include "Components/SkeletalMeshComponent.h"
+#include "Engine/SkeletalMesh.h"
+#include "Engine/World.h"
+#include "GameFramework/Actor.h"
+#include "HAL/ConsoleManager.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+#include "Async/Async.h"
+
+bool FSkinnedDecalTraceRecorder::bRecording = false;
+double FSkinnedDecalTraceRecorder::StartTime = 0.0;
+FString FSkinnedDecalTraceRecorder::TraceFileName;
+FSkinnedDecalTrace FSkinnedDecalTraceRecorder::Trace;
+TMap<TWeakObjectPtr<const USkinnedDecalSampler>, uint16> FSkinnedDecalTraceRecorder::SamplerIds;
+TMap<FString, uint16> FSkinnedDecalTraceRecorder::NameIds;
+
+TUniquePtr<FSkinnedDecalTraceReplayer> FSkinnedDecalTraceReplayer::Active;
+
+static const TCHAR* EventNames[] = { TEXT("SpawnDecal"), TEXT("RemoveDecal"), TEXT("ClearAllDecals"), TEXT("CloneDecals") };
+
+//Vectors are always stored as floats so traces match between engine versions
+static void SerializeVector(FArchive& Ar, FVector& Vector)
+{
+	float X = Vector.X, Y = Vector.Y, Z = Vector.Z;
+	Ar << X << Y << Z;
+	Vector = FVector(X, Y, Z);
+}
+
+static void SerializeQuat(FArchive& Ar, FQuat& Quat)
+{
+	float X = Quat.X, Y = Quat.Y, Z = Quat.Z, W = Quat.W;
+	Ar << X << Y << Z << W;
+	Quat = FQuat(X, Y, Z, W);
+}
+
+static FString GetTracePath(const FString& FileName)
+{
+	FString Path = FileName;
+	if (Path.IsEmpty())
+	{
+		Path = FString::Printf(TEXT("SkinnedDecal-%s.sdtrace"), *FDateTime::Now().ToString());
+	}
+	if (FPaths::IsRelative(Path))
+	{
+		Path = FPaths::Combine(FPaths::ProfilingDir(), TEXT("SkinnedDecal"), Path);
+	}
+	return Path;
+}
+
+////////
+// Trace
+
+FArchive& operator<<(FArchive& Ar, FSkinnedDecalTraceSampler& Sampler)
+{
+	Ar << Sampler.OwnerName;
+	Ar << Sampler.MaxDecals;
+	Ar << Sampler.MinDecalDistance;
+	Ar << Sampler.AdditionalData;
+	Ar << Sampler.TranslucentBlend;
+	Ar << Sampler.LayerNames;
+	Ar << Sampler.LayerMaxDecals;
+	Ar << Sampler.ClusterDecals;
+	Ar << Sampler.ClusterRadius;
+	Ar << Sampler.ClusterGrowth;
+	Ar << Sampler.ClusterMaxSize;
+	Ar << Sampler.ClusterHitsPerSubUV;
+	Ar << Sampler.ClusterMaxSubUV;
+	return Ar;
+}
+
+FArchive& operator<<(FArchive& Ar, FSkinnedDecalTraceEvent& Event)
+{
+	uint8 Type = (uint8)Event.Type;
+	Ar << Type;
+	Event.Type = (ESkinnedDecalTraceEvent)Type;
+	Ar << Event.SamplerId;
+	Ar << Event.Time;
+
+	switch (Event.Type)
+	{
+	case ESkinnedDecalTraceEvent::Spawn:
+		Ar << Event.Index;
+		Ar << Event.ResultIndex;
+		Ar << Event.MeshName;
+		Ar << Event.BoneName;
+		Ar << Event.LayerName;
+		Ar << Event.BoneIndex;
+		SerializeVector(Ar, Event.Location);
+		SerializeQuat(Ar, Event.Rotation);
+		Ar << Event.Size;
+		Ar << Event.SubUV;
+		break;
+
+	case ESkinnedDecalTraceEvent::Remove:
+		Ar << Event.Index;
+		break;
+
+	case ESkinnedDecalTraceEvent::Clear:
+		break;
+
+	case ESkinnedDecalTraceEvent::Clone:
+		Ar << Event.SourceSamplerId;
+		break;
+
+	default:
+		Ar.SetError();
+		break;
+	}
+	return Ar;
+}
+
+FArchive& operator<<(FArchive& Ar, FSkinnedDecalTrace& Trace)
+{
+	uint32 Magic = FSkinnedDecalTrace::Magic;
+	uint32 Version = FSkinnedDecalTrace::Version;
+	Ar << Magic << Version;
+	if (Magic != FSkinnedDecalTrace::Magic || Version != FSkinnedDecalTrace::Version)
+	{
+		Ar.SetError();
+		return Ar;
+	}
+
+	Ar << Trace.Names;
+	Ar << Trace.Samplers;
+	Ar << Trace.Events;
+	return Ar;
+}
+
+bool FSkinnedDecalTrace::SaveToFile(const FString& FileName)
+{
+	TArray<uint8> Data;
+	FMemoryWriter Writer(Data);
+	Writer << *this;
+	return FFileHelper::SaveArrayToFile(Data, *FileName);
+}
+
+bool FSkinnedDecalTrace::LoadFromFile(const FString& FileName)
+{
+	TArray<uint8> Data;
+	if (!FFileHelper::LoadFileToArray(Data, *FileName))
+	{
+		return false;
+	}
+	FMemoryReader Reader(Data);
+	Reader << *this;
+	return !Reader.IsError();
+}
+
+////////
+// Recorder
+
+void FSkinnedDecalTraceRecorder::Start(const FString& FileName)
+{
+	if (FSkinnedDecalTraceReplayer::IsReplaying())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace recording is not available while replaying"));
+		return;
+	}
+
+	if (bRecording)
+	{
+		Stop();
+	}
+
+	TraceFileName = GetTracePath(FileName);
+	Trace = FSkinnedDecalTrace();
+	SamplerIds.Empty();
+	NameIds.Empty();
+	StartTime = FPlatformTime::Seconds();
+	bRecording = true;
+
+	UE_LOG(LogTemp, Log, TEXT("SkinnedDecal trace recording to %s"), *TraceFileName);
+}
+
+void FSkinnedDecalTraceRecorder::Stop()
+{
+	if (!bRecording) return;
+	bRecording = false;
+
+	if (Trace.SaveToFile(TraceFileName))
+	{
+		UE_LOG(LogTemp, Log, TEXT("SkinnedDecal trace saved %d events, %d samplers to %s"), Trace.Events.Num(), Trace.Samplers.Num(), *TraceFileName);
+	}
+	else
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace could not be written to %s"), *TraceFileName);
+	}
+
+	Trace = FSkinnedDecalTrace();
+	SamplerIds.Empty();
+	NameIds.Empty();
+}
+
+int32 FSkinnedDecalTraceRecorder::GetSamplerId(const USkinnedDecalSampler* Sampler)
+{
+	if (const uint16* Id = SamplerIds.Find(Sampler))
+	{
+		return *Id;
+	}
+	if (Trace.Samplers.Num() >= MAX_uint16)
+	{
+		return INDEX_NONE;
+	}
+
+	FSkinnedDecalTraceSampler& Desc = Trace.Samplers.AddDefaulted_GetRef();
+	Desc.OwnerName = Sampler->GetOwner() ? Sampler->GetOwner()->GetName() : Sampler->GetName();
+	Desc.MaxDecals = Sampler->MaxDecals;
+	Desc.MinDecalDistance = Sampler->MinDecalDistance;
+	Desc.AdditionalData = Sampler->AdditionalData;
+	Desc.TranslucentBlend = Sampler->TranslucentBlend;
+	Desc.ClusterDecals = Sampler->ClusterDecals;
+	Desc.ClusterRadius = Sampler->ClusterRadius;
+	Desc.ClusterGrowth = Sampler->ClusterGrowth;
+	Desc.ClusterMaxSize = Sampler->ClusterMaxSize;
+	Desc.ClusterHitsPerSubUV = Sampler->ClusterHitsPerSubUV;
+	Desc.ClusterMaxSubUV = Sampler->ClusterMaxSubUV;
+	for (const FSkinnedDecalLayer& Layer : Sampler->ActiveLayers)
+	{
+		Desc.LayerNames.Add(Layer.Name.ToString());
+		Desc.LayerMaxDecals.Add(Layer.MaxDecals);
+	}
+
+	const uint16 Id = Trace.Samplers.Num() - 1;
+	SamplerIds.Add(Sampler, Id);
+	return Id;
+}
+
+int32 FSkinnedDecalTraceRecorder::GetNameId(const FString& Name)
+{
+	if (const uint16* Id = NameIds.Find(Name))
+	{
+		return *Id;
+	}
+	//MAX_uint16 is reserved for "no name" in the replayer
+	if (Trace.Names.Num() >= MAX_uint16)
+	{
+		return INDEX_NONE;
+	}
+	const uint16 Id = Trace.Names.Add(Name);
+	NameIds.Add(Name, Id);
+	return Id;
+}
+
+bool FSkinnedDecalTraceRecorder::CheckIds(std::initializer_list<int32> Ids)
+{
+	for (const int32 Id : Ids)
+	{
+		if (Id == INDEX_NONE)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace has too many samplers or names, recording stopped"));
+			Stop();
+			return false;
+		}
+	}
+	return true;
+}
+
+FSkinnedDecalTraceEvent& FSkinnedDecalTraceRecorder::AddEvent(int32 SamplerId, ESkinnedDecalTraceEvent Type)
+{
+	FSkinnedDecalTraceEvent& Event = Trace.Events.AddDefaulted_GetRef();
+	Event.Type = Type;
+	Event.SamplerId = SamplerId;
+	Event.Time = FPlatformTime::Seconds() - StartTime;
+	return Event;
+}
+
+void FSkinnedDecalTraceRecorder::RecordSpawn(const USkinnedDecalSampler* Sampler, FName BoneName, int32 BoneIndex, const FVector& Location, const FQuat& Rotation, float Size, int32 SubUV, int32 Index, int32 ResultIndex, FName Layer)
+{
+	const int32 SamplerId = GetSamplerId(Sampler);
+	const int32 MeshName = GetNameId(Sampler->Mesh && Sampler->Mesh->SkeletalMesh ? Sampler->Mesh->SkeletalMesh->GetPathName() : FString());
+	const int32 BoneNameId = GetNameId(BoneName.ToString());
+	const int32 LayerName = GetNameId(Layer.ToString());
+	if (!CheckIds({ SamplerId, MeshName, BoneNameId, LayerName })) return;
+
+	FSkinnedDecalTraceEvent& Event = AddEvent(SamplerId, ESkinnedDecalTraceEvent::Spawn);
+	Event.Index = Index;
+	Event.ResultIndex = ResultIndex;
+	Event.MeshName = MeshName;
+	Event.BoneName = BoneNameId;
+	Event.LayerName = LayerName;
+	Event.BoneIndex = BoneIndex;
+	Event.Location = Location;
+	Event.Rotation = Rotation;
+	Event.Size = Size;
+	Event.SubUV = SubUV;
+}
+
+void FSkinnedDecalTraceRecorder::RecordRemove(const USkinnedDecalSampler* Sampler, int32 Index)
+{
+	const int32 SamplerId = GetSamplerId(Sampler);
+	if (!CheckIds({ SamplerId })) return;
+
+	AddEvent(SamplerId, ESkinnedDecalTraceEvent::Remove).Index = Index;
+}
+
+void FSkinnedDecalTraceRecorder::RecordClear(const USkinnedDecalSampler* Sampler)
+{
+	const int32 SamplerId = GetSamplerId(Sampler);
+	if (!CheckIds({ SamplerId })) return;
+
+	AddEvent(SamplerId, ESkinnedDecalTraceEvent::Clear);
+}
+
+void FSkinnedDecalTraceRecorder::RecordClone(const USkinnedDecalSampler* Sampler, const USkinnedDecalSampler* Source)
+{
+	const int32 SourceId = GetSamplerId(Source);
+	const int32 SamplerId = GetSamplerId(Sampler);
+	if (!CheckIds({ SourceId, SamplerId })) return;
+
+	AddEvent(SamplerId, ESkinnedDecalTraceEvent::Clone).SourceSamplerId = SourceId;
+}
+
+////////
+// Replayer
+
+FSkinnedDecalTraceReplayer::FSkinnedDecalTraceReplayer(UWorld* InWorld, FSkinnedDecalTrace&& InTrace, bool bInMaxSpeed)
+	: World(InWorld)
+	, Trace(MoveTemp(InTrace))
+	, bMaxSpeed(bInMaxSpeed)
+{
+	Samplers.SetNum(Trace.Samplers.Num());
+	SlotRemap.SetNum(Trace.Samplers.Num());
+	StartTime = FPlatformTime::Seconds();
+}
+
+FSkinnedDecalTraceReplayer::~FSkinnedDecalTraceReplayer()
+{
+	DestroyActors();
+}
+
+void FSkinnedDecalTraceReplayer::DestroyActors()
+{
+	for (const TWeakObjectPtr<AActor>& Actor : ReplayActors)
+	{
+		if (Actor.IsValid())
+		{
+			Actor->Destroy();
+		}
+	}
+	ReplayActors.Empty();
+	Samplers.Empty();
+}
+
+void FSkinnedDecalTraceReplayer::StopReplay()
+{
+	Active.Reset();
+}
+
+void FSkinnedDecalTraceReplayer::Replay(UWorld* World, const FString& FileName, bool bMaxSpeed)
+{
+	if (!World) return;
+
+	if (FSkinnedDecalTraceRecorder::IsRecording())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace replay is not available while recording"));
+		return;
+	}
+
+	FSkinnedDecalTrace Trace;
+	const FString Path = GetTracePath(FileName);
+	if (!Trace.LoadFromFile(Path))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace could not be read from %s"), *Path);
+		return;
+	}
+
+	if (Trace.Events.Num() == 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal trace %s has no events to replay"), *Path);
+		return;
+	}
+
+	UE_LOG(LogTemp, Log, TEXT("SkinnedDecal trace replaying %d events from %s"), Trace.Events.Num(), *Path);
+	Active.Reset();
+	Active = MakeUnique<FSkinnedDecalTraceReplayer>(World, MoveTemp(Trace), bMaxSpeed);
+}
+
+FName FSkinnedDecalTraceReplayer::GetName(uint16 NameId) const
+{
+	return Trace.Names.IsValidIndex(NameId) ? FName(*Trace.Names[NameId]) : NAME_None;
+}
+
+USkinnedDecalSampler* FSkinnedDecalTraceReplayer::GetSampler(uint16 SamplerId, uint16 MeshName)
+{
+	if (!Samplers.IsValidIndex(SamplerId)) return nullptr;
+
+	USkinnedDecalSampler* Sampler = Samplers[SamplerId].Get();
+	if (!Sampler)
+	{
+		if (!World.IsValid()) return nullptr;
+
+		//One actor per sampler, SetMeshComponent clears translucent meshes of the whole owner
+		AActor* Actor = World->SpawnActor<AActor>();
+		if (!Actor) return nullptr;
+		ReplayActors.Add(Actor);
+
+		const FSkinnedDecalTraceSampler& Desc = Trace.Samplers[SamplerId];
+		Sampler = NewObject<USkinnedDecalSampler>(Actor, *FString::Printf(TEXT("Replay_%s"), *Desc.OwnerName));
+		Sampler->MaxDecals = Desc.MaxDecals;
+		Sampler->MinDecalDistance = Desc.MinDecalDistance;
+		Sampler->AdditionalData = (ESkinnedDecalAdditionalData)Desc.AdditionalData;
+		Sampler->TranslucentBlend = Desc.TranslucentBlend;
+		Sampler->ClusterDecals = Desc.ClusterDecals;
+		Sampler->ClusterRadius = Desc.ClusterRadius;
+		Sampler->ClusterGrowth = Desc.ClusterGrowth;
+		Sampler->ClusterMaxSize = Desc.ClusterMaxSize;
+		Sampler->ClusterHitsPerSubUV = Desc.ClusterHitsPerSubUV;
+		Sampler->ClusterMaxSubUV = Desc.ClusterMaxSubUV;
+		for (int32 i = 0; i < Desc.LayerNames.Num() && i < Desc.LayerMaxDecals.Num(); ++i)
+		{
+			FSkinnedDecalLayer& Layer = Sampler->Layers.AddDefaulted_GetRef();
+			Layer.Name = *Desc.LayerNames[i];
+			Layer.MaxDecals = Desc.LayerMaxDecals[i];
+		}
+		Sampler->MaterialsSupportDecalOffset = Sampler->Layers.Num() > 1;
+		Sampler->RegisterComponent();
+		Actor->AddInstanceComponent(Sampler);
+		Samplers[SamplerId] = Sampler;
+	}
+
+	//Mesh is optional, without it only the data texture upload is replayed
+	if (!Sampler->Mesh && Trace.Names.IsValidIndex(MeshName) && !Trace.Names[MeshName].IsEmpty())
+	{
+		if (USkeletalMesh* SkeletalMesh = LoadObject<USkeletalMesh>(nullptr, *Trace.Names[MeshName]))
+		{
+			AActor* Actor = Sampler->GetOwner();
+			USkeletalMeshComponent* MeshComponent = NewObject<USkeletalMeshComponent>(Actor);
+			MeshComponent->SetSkeletalMesh(SkeletalMesh);
+			MeshComponent->RegisterComponent();
+			Actor->AddInstanceComponent(MeshComponent);
+			Actor->SetRootComponent(MeshComponent);
+			Sampler->SetMeshComponent(MeshComponent);
+		}
+	}
+	return Sampler;
+}
+
+void FSkinnedDecalTraceReplayer::Dispatch(const FSkinnedDecalTraceEvent& Event)
+{
+	USkinnedDecalSampler* Sampler = GetSampler(Event.SamplerId, Event.Type == ESkinnedDecalTraceEvent::Spawn ? Event.MeshName : MAX_uint16);
+	if (!Sampler) return;
+
+	//Resolve before timing, creating a sampler is not part of the call cost
+	USkinnedDecalSampler* Source = nullptr;
+	if (Event.Type == ESkinnedDecalTraceEvent::Clone)
+	{
+		Source = GetSampler(Event.SourceSamplerId);
+		if (!Source) return;
+	}
+
+	TMap<int32, int32>& Remap = SlotRemap[Event.SamplerId];
+	const double EventStart = FPlatformTime::Seconds();
+
+	switch (Event.Type)
+	{
+	case ESkinnedDecalTraceEvent::Spawn:
+		{
+			const int32* Index = Event.Index < 0 ? nullptr : Remap.Find(Event.Index);
+			const int32 ResultIndex = Sampler->SpawnDecalInReferencePose(Event.Location, Event.Rotation, Event.BoneIndex, Event.Size, Event.SubUV, Index ? *Index : Event.Index, GetName(Event.LayerName));
+			if (Event.ResultIndex >= 0 && ResultIndex >= 0)
+			{
+				Remap.Add(Event.ResultIndex, ResultIndex);
+			}
+		}
+		break;
+
+	case ESkinnedDecalTraceEvent::Remove:
+		{
+			const int32* Index = Remap.Find(Event.Index);
+			Sampler->RemoveDecal(Index ? *Index : Event.Index);
+		}
+		break;
+
+	case ESkinnedDecalTraceEvent::Clear:
+		Sampler->ClearAllDecals();
+		break;
+
+	case ESkinnedDecalTraceEvent::Clone:
+		Sampler->CloneDecals(Source);
+		Remap = SlotRemap[Event.SourceSamplerId];
+		break;
+	}
+
+	const double Elapsed = FPlatformTime::Seconds() - EventStart;
+	FTiming& Timing = Timings[(uint8)Event.Type];
+	++Timing.Count;
+	Timing.Total += Elapsed;
+	Timing.Max = FMath::Max(Timing.Max, Elapsed);
+}
+
+void FSkinnedDecalTraceReplayer::Tick(float DeltaTime)
+{
+	const double Elapsed = FPlatformTime::Seconds() - StartTime;
+
+	while (!IsFinished() && (bMaxSpeed || Trace.Events[NextEvent].Time <= Elapsed))
+	{
+		Dispatch(Trace.Events[NextEvent++]);
+	}
+
+	if (IsFinished())
+	{
+		Report();
+		DestroyActors();
+		bReported = true;
+
+		//Not safe to delete a tickable from its own Tick
+		AsyncTask(ENamedThreads::GameThread, []()
+		{
+			if (Active && Active->bReported)
+			{
+				Active.Reset();
+			}
+		});
+	}
+}
+
+void FSkinnedDecalTraceReplayer::Report() const
+{
+	UE_LOG(LogTemp, Log, TEXT("SkinnedDecal trace replay finished: %d events, %d samplers, %.2f ms wall (%s speed)"),
+		Trace.Events.Num(), Trace.Samplers.Num(), (FPlatformTime::Seconds() - StartTime) * 1000.0, bMaxSpeed ? TEXT("max") : TEXT("original"));
+
+	for (int32 i = 0; i < UE_ARRAY_COUNT(Timings); ++i)
+	{
+		const FTiming& Timing = Timings[i];
+		if (Timing.Count == 0) continue;
+
+		UE_LOG(LogTemp, Log, TEXT("  %-15s count %6d  total %8.3f ms  avg %8.2f us  max %8.2f us"),
+			EventNames[i], Timing.Count, Timing.Total * 1000.0, Timing.Total / Timing.Count * 1000000.0, Timing.Max * 1000000.0);
+	}
+}
+
+////////
+// Console commands
+
+static FAutoConsoleCommand SkinnedDecalTraceStartCommand(
+	TEXT("SkinnedDecal.Trace.Start"),
+	TEXT("Starts recording SpawnDecal/RemoveDecal/ClearAllDecals/CloneDecals calls. Optional file name, relative to Saved/Profiling/SkinnedDecal."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FSkinnedDecalTraceRecorder::Start(Args.Num() > 0 ? Args[0] : FString());
+	}));
+
+static FAutoConsoleCommand SkinnedDecalTraceStopCommand(
+	TEXT("SkinnedDecal.Trace.Stop"),
+	TEXT("Stops recording and writes the decal trace."),
+	FConsoleCommandDelegate::CreateLambda([]()
+	{
+		FSkinnedDecalTraceRecorder::Stop();
+	}));
+
+static FAutoConsoleCommand SkinnedDecalTraceReplayCommand(
+	TEXT("SkinnedDecal.Trace.Replay"),
+	TEXT("SkinnedDecal.Trace.Replay <File> [Max]. Replays a decal trace into transient samplers and logs timing. Max ignores recorded timestamps."),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
+	{
+		if (Args.Num() < 1)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("SkinnedDecal.Trace.Replay <File> [Max]"));
+			return;
+		}
+		FSkinnedDecalTraceReplayer::Replay(World, Args[0], Args.Num() > 1 && Args[1].Equals(TEXT("Max"), ESearchCase::IgnoreCase));
+	}));
@@ -36,6 +36,9 @@ public:
 		int32 SubUV = 0;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ExposeOnSpawn="true"), Category = "SkinnedDecal")
 		float Size = 10.f;
+	// Sampler layer name. If Index is not a slot of this layer, a new slot is allocated in it.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, meta = (ExposeOnSpawn="true"), Category = "SkinnedDecal")
+		FName Layer = NAME_None;
 
 	UFUNCTION(BlueprintCallable, Category = "SkinnedDecal")
 	USkinnedDecalSampler* GetSampler();
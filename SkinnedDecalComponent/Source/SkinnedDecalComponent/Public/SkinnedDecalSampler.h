@@ -19,6 +19,46 @@ enum ESkinnedDecalAdditionalData
 };
 
 
+USTRUCT(BlueprintType)
+struct FSkinnedDecalLayer
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layer")
+	FName Name;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layer")
+	int32 LayerIndex = -1;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layer")
+	TEnumAsByte<EMaterialParameterAssociation> Association = EMaterialParameterAssociation::GlobalParameter;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layer")
+	int32 MaxDecals = 100;
+
+	// First decal slot of this layer in the shared data texture, passed to the material as DecalOffset
+	UPROPERTY(Transient, BlueprintReadOnly, Category = "Layer")
+	int32 Offset = 0;
+
+	// Local slot of the last spawned decal, used for eviction
+	UPROPERTY(Transient, BlueprintReadOnly, Category = "Layer")
+	int32 LastDecalIndex = -1;
+
+	// Used slots of this layer, passed to the material as DecalLast
+	UPROPERTY(Transient, BlueprintReadOnly, Category = "Layer")
+	int32 NumDecals = 0;
+};
+
+// Merged hits of one decal slot, only tracked when ClusterDecals is on
+struct FSkinnedDecalCluster
+{
+	FQuat Rotation = FQuat::Identity;
+	float Size = 0.f;
+	int32 SubUV = 0;
+	int32 BoneIndex = INDEX_NONE;
+	int32 Hits = 0;
+};
+
 class USkinnedDecalInstance;
 UCLASS(Blueprintable, BlueprintType, hidecategories = (Collision, Object, Physics, SceneComponent, Activation, "Components|Activation", Mobility), ClassGroup = Rendering, meta = (BlueprintSpawnableComponent))
 class SKINNEDDECALCOMPONENT_API USkinnedDecalSampler : public UActorComponent
@@ -34,8 +74,12 @@ public:
 	USkeletalMeshComponent* Mesh;
 
 	UFUNCTION(BlueprintCallable, Category = "Skinned Decal Component")
-	int32 SpawnDecal(FVector Location, const FQuat Rotation, FName BoneName = NAME_None, float Size = 10.f, int32 SubUV = 0, int32 Index = -1);
+	int32 SpawnDecal(FVector Location, const FQuat Rotation, FName BoneName = NAME_None, float Size = 10.f, int32 SubUV = 0, int32 Index = -1, FName Layer = NAME_None);
 	
+	// Same as SpawnDecal but takes a location/rotation already in the mesh reference pose
+	UFUNCTION(BlueprintCallable, Category = "Skinned Decal Component")
+	int32 SpawnDecalInReferencePose(FVector DecalLocation, const FQuat DecalRotation, int32 BoneIndex = -1, float Size = 10.f, int32 SubUV = 0, int32 Index = -1, FName Layer = NAME_None);
+
 	UFUNCTION(BlueprintCallable, Category = "Skinned Decal Component")
 	void RemoveDecal(const int32 Index = -1);
 
@@ -54,12 +98,32 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Skinned Decal Component")
 	void CloneDecals(USkinnedDecalSampler* Source);
 
+	// Layer a decal slot belongs to, INDEX_NONE if out of range
+	UFUNCTION(BlueprintPure, Category = "Skinned Decal Component")
+	int32 GetLayerOfDecal(int32 Index) const;
+
+	// Layer by name, NAME_None is the first layer
+	UFUNCTION(BlueprintPure, Category = "Skinned Decal Component")
+	int32 FindLayer(FName Layer) const;
+
 	UPROPERTY(BlueprintReadOnly, Category = "Decals")
 	TArray<FVector> DecalLocations;
 
 	UPROPERTY(BlueprintReadOnly, Category = "Decals")
 	TArray<int32> EmptyIndexes;
 	
+	// Decal layers sharing one data texture and one set of materials. When empty, a single layer is made from LayerIndex, Association and MaxDecals.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layers")
+	TArray<FSkinnedDecalLayer> Layers;
+
+	// Set once the decal material functions add DecalOffset to the slot index. The shipped ones don't, so until then only the first layer is used.
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Layers")
+	bool MaterialsSupportDecalOffset = false;
+
+	// Layout in use, built from Layers by InitLayers
+	UPROPERTY(Transient, BlueprintReadOnly, Category = "Layers")
+	TArray<FSkinnedDecalLayer> ActiveLayers;
+
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Material")
 	int32 LayerIndex = -1;
 
@@ -81,6 +145,27 @@ public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Performance")
 	float MinDecalDistance = 10.f;
 
+	// Hits closer than ClusterRadius to a decal on the same bone grow that decal instead of taking a new slot
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering")
+	bool ClusterDecals = false;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering", meta = (EditCondition = "ClusterDecals"))
+	float ClusterRadius = 5.f;
+
+	// Size added per merged hit, as a fraction of the hit size
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering", meta = (EditCondition = "ClusterDecals"))
+	float ClusterGrowth = 0.25f;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering", meta = (EditCondition = "ClusterDecals"))
+	float ClusterMaxSize = 30.f;
+
+	// Merged hits per SubUV step, 0 keeps the SubUV of the first hit
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering", meta = (EditCondition = "ClusterDecals"))
+	int32 ClusterHitsPerSubUV = 0;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Clustering", meta = (EditCondition = "ClusterDecals"))
+	int32 ClusterMaxSubUV = 3;
+
 	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Translucent Blend")
 	bool TranslucentBlend = true;
 
@@ -108,6 +193,27 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Skinned Decal Component")
 	void SetupComponentMaterials(USkeletalMeshComponent* Component);
 
+	// Adds the default layer and lays out layer offsets. Recreates the data texture if the layout changed after it was made.
+	void InitLayers();
+
+	// Decal slots of all layers, the data texture is 5 pixels per slot
+	int32 GetDecalSlotCount() const;
+
+	void SetLayerParameters(UMaterialInstanceDynamic* DynamicMaterial, const FSkinnedDecalLayer& Layer);
+
+	int32 FindCluster(const FSkinnedDecalLayer& Layer, const FVector& DecalLocation, int32 BoneIndex) const;
+
+	// RemoveDecal without trace recording
+	void RemoveDecalSlot(const int32 Index);
+
+	// SpawnDecalInReferencePose without trace recording
+	int32 SpawnDecalInternal(const FVector& DecalLocation, const FQuat& DecalRotation, int32 BoneIndex, float Size, int32 SubUV, int32 Index, FName Layer);
+
+	// Writes one decal slot of the data texture
+	bool UploadDecal(int32 DecalIndex, const FVector& DecalLocation, const FQuat& DecalRotation, int32 BoneIndex, float Size, int32 SubUV);
+
+	TArray<FSkinnedDecalCluster> Clusters;
+
 	UPROPERTY()
 	UTextureRenderTarget2D* DataTarget;
 };
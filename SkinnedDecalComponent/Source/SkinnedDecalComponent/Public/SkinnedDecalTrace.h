@@ -0,0 +1,162 @@
+// Copyright Eddie Ataberk 2021 All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Tickable.h"
+
+class AActor;
+class USkinnedDecalSampler;
+class UWorld;
+
+// Binary trace of decal sampler traffic, used to reproduce live hit patterns offline.
+// Recording is opt-in: "SkinnedDecal.Trace.Start [File]" / "SkinnedDecal.Trace.Stop".
+// Replay: "SkinnedDecal.Trace.Replay <File> [Max]".
+
+enum class ESkinnedDecalTraceEvent : uint8
+{
+	Spawn,
+	Remove,
+	Clear,
+	Clone,
+};
+
+struct FSkinnedDecalTraceSampler
+{
+	FString OwnerName;
+	int32 MaxDecals = 100;
+	float MinDecalDistance = 10.f;
+	uint8 AdditionalData = 0;
+	bool TranslucentBlend = true;
+	TArray<FString> LayerNames;
+	TArray<int32> LayerMaxDecals;
+	bool ClusterDecals = false;
+	float ClusterRadius = 5.f;
+	float ClusterGrowth = 0.25f;
+	float ClusterMaxSize = 30.f;
+	int32 ClusterHitsPerSubUV = 0;
+	int32 ClusterMaxSubUV = 3;
+
+	friend FArchive& operator<<(FArchive& Ar, FSkinnedDecalTraceSampler& Sampler);
+};
+
+struct FSkinnedDecalTraceEvent
+{
+	ESkinnedDecalTraceEvent Type = ESkinnedDecalTraceEvent::Spawn;
+	uint16 SamplerId = 0;
+	// Seconds since the recording started
+	float Time = 0.f;
+
+	// Spawn: requested and returned slot. Remove: slot being removed.
+	int32 Index = -1;
+	int32 ResultIndex = -1;
+
+	// Spawn only. Mesh, bone and layer are indexes into the trace name table.
+	uint16 MeshName = 0;
+	uint16 BoneName = 0;
+	uint16 LayerName = 0;
+	int16 BoneIndex = INDEX_NONE;
+	FVector Location = FVector::ZeroVector;
+	FQuat Rotation = FQuat::Identity;
+	float Size = 0.f;
+	int32 SubUV = 0;
+
+	// Clone only
+	uint16 SourceSamplerId = 0;
+
+	friend FArchive& operator<<(FArchive& Ar, FSkinnedDecalTraceEvent& Event);
+};
+
+struct SKINNEDDECALCOMPONENT_API FSkinnedDecalTrace
+{
+	static const uint32 Magic = 0x54434453; // "SDCT"
+	static const uint32 Version = 3;
+
+	TArray<FString> Names;
+	TArray<FSkinnedDecalTraceSampler> Samplers;
+	TArray<FSkinnedDecalTraceEvent> Events;
+
+	bool SaveToFile(const FString& FileName);
+	bool LoadFromFile(const FString& FileName);
+
+	friend FArchive& operator<<(FArchive& Ar, FSkinnedDecalTrace& Trace);
+};
+
+class SKINNEDDECALCOMPONENT_API FSkinnedDecalTraceRecorder
+{
+public:
+	static void Start(const FString& FileName);
+	static void Stop();
+
+	static bool IsRecording() { return bRecording; }
+
+	// Ref-pose location/rotation, after bone space conversion
+	static void RecordSpawn(const USkinnedDecalSampler* Sampler, FName BoneName, int32 BoneIndex, const FVector& Location, const FQuat& Rotation, float Size, int32 SubUV, int32 Index, int32 ResultIndex, FName Layer);
+	static void RecordRemove(const USkinnedDecalSampler* Sampler, int32 Index);
+	static void RecordClear(const USkinnedDecalSampler* Sampler);
+	static void RecordClone(const USkinnedDecalSampler* Sampler, const USkinnedDecalSampler* Source);
+
+private:
+	static FSkinnedDecalTraceEvent& AddEvent(int32 SamplerId, ESkinnedDecalTraceEvent Type);
+	// Ids are stored as uint16, INDEX_NONE once a table is full
+	static int32 GetSamplerId(const USkinnedDecalSampler* Sampler);
+	static int32 GetNameId(const FString& Name);
+	static bool CheckIds(std::initializer_list<int32> Ids);
+
+	static bool bRecording;
+	static double StartTime;
+	static FString TraceFileName;
+	static FSkinnedDecalTrace Trace;
+	static TMap<TWeakObjectPtr<const USkinnedDecalSampler>, uint16> SamplerIds;
+	static TMap<FString, uint16> NameIds;
+};
+
+// Feeds a trace back into transient samplers spawned in the given world and logs per-call timing.
+class SKINNEDDECALCOMPONENT_API FSkinnedDecalTraceReplayer : public FTickableGameObject
+{
+public:
+	FSkinnedDecalTraceReplayer(UWorld* InWorld, FSkinnedDecalTrace&& InTrace, bool bInMaxSpeed);
+	virtual ~FSkinnedDecalTraceReplayer();
+
+	static void Replay(UWorld* World, const FString& FileName, bool bMaxSpeed);
+	static void StopReplay();
+	static bool IsReplaying() { return Active.IsValid() && !Active->bReported; }
+
+	bool IsFinished() const { return NextEvent >= Trace.Events.Num(); }
+
+	//~ Begin FTickableGameObject Interface
+	virtual void Tick(float DeltaTime) override;
+	virtual bool IsTickable() const override { return !bReported; }
+	virtual bool IsTickableInEditor() const override { return true; }
+	virtual TStatId GetStatId() const override { RETURN_QUICK_DECLARE_CYCLE_STAT(FSkinnedDecalTraceReplayer, STATGROUP_Tickables); }
+	//~ End FTickableGameObject Interface
+
+private:
+	struct FTiming
+	{
+		int32 Count = 0;
+		double Total = 0.0;
+		double Max = 0.0;
+	};
+
+	USkinnedDecalSampler* GetSampler(uint16 SamplerId, uint16 MeshName = MAX_uint16);
+	FName GetName(uint16 NameId) const;
+	void Dispatch(const FSkinnedDecalTraceEvent& Event);
+	void Report() const;
+	void DestroyActors();
+
+	TWeakObjectPtr<UWorld> World;
+	TArray<TWeakObjectPtr<AActor>> ReplayActors;
+	FSkinnedDecalTrace Trace;
+	bool bMaxSpeed;
+	bool bReported = false;
+	int32 NextEvent = 0;
+	double StartTime = 0.0;
+
+	TArray<TWeakObjectPtr<USkinnedDecalSampler>> Samplers;
+	// Recorded slot -> replayed slot, per sampler, so allocator changes don't break Remove/Update events
+	TArray<TMap<int32, int32>> SlotRemap;
+	FTiming Timings[4];
+
+	static TUniquePtr<FSkinnedDecalTraceReplayer> Active;
+};